@@ -10,41 +10,7 @@
 #include <windows.h>
 #endif
 
-class TokenManager {
-private:
-    std::unordered_map<std::string, bool> validTokens;
-    int attackCount = 0;
-    const int attackThreshold = 5; 
-    const std::string logFile = "defense_log.txt";
-
-    void logAttack(const std::string& detail) {
-        std::ofstream logStream(logFile, std::ios::app);
-        if (logStream.is_open()) {
-            logStream << detail << std::endl;
-            logStream.close();
-        }
-    }
-
-public:
-    void addToken(const std::string& token) {
-        validTokens[token] = true;
-    }
-
-    int validateToken(const std::string& token) {
-        if (validTokens.find(token) != validTokens.end() && validTokens[token]) {
-            return 0; 
-        } else {
-            attackCount++;
-            logAttack("[警告] 惡意攻擊: 使用 token " + token + " | 攻擊次數: " + std::to_string(attackCount));
-            if (attackCount >= attackThreshold) return 2;
-            return 1;
-        }
-    }
-
-    bool isBlocked() { return attackCount >= attackThreshold; }
-    int getAttackCount() { return attackCount; }
-    int getThreshold() { return attackThreshold; }
-};
+#include "token_store.h"
 
 // 移除 Windows 的 \r 換行符
 std::string cleanString(std::string s) {
@@ -67,6 +33,14 @@ std::string inputValidatedKey(const std::string& prompt) {
     return key;
 }
 
+// 持久化失敗時接在該次結果之後顯示，不影響本次回應
+void printStateError(TokenManager& tokenManager) {
+    std::string detail = tokenManager.takeStateError();
+    if (!detail.empty()) {
+        std::cout << "[STATE] 警告: " << detail << "\n";
+    }
+}
+
 struct ApiRequest {
     std::string token;
     std::string payload;
@@ -85,7 +59,21 @@ int main() {
 
     TokenManager tokenManager;
 
-    // 3. 初始化
+    // 3. 還原上次的 token 與鎖定狀態 (快照 + 日誌尾端)
+    TokenManager::RecoveryStats stats = tokenManager.restore();
+    if (stats.snapshotCorrupt) {
+        std::cout << "[STATE] 快照損毀，已移至 defense_state.snap.corrupt 保留，僅從日誌還原 (攻擊次數可能少計)\n";
+    }
+    if (stats.tornTail) {
+        std::cout << "[STATE] 日誌尾端不完整 (前次異常終止)，已截斷至最後一筆完整記錄\n";
+    }
+    std::cout << "[STATE] 已還原狀態: 快照 token " << stats.snapshotTokens
+              << " 筆，重播日誌 " << stats.replayedRecords
+              << " 筆，攻擊次數 " << tokenManager.getAttackCount()
+              << " (" << stats.millis << " ms)\n";
+    printStateError(tokenManager);
+
+    // 4. 初始化
     std::string key1 = inputValidatedKey("請輸入設定密鑰 (8-16字元): ");
     std::string key2 = inputValidatedKey("請再次輸入以確認: ");
     
@@ -94,10 +82,10 @@ int main() {
         return 1;
     }
     
-    tokenManager.addToken(key1);
+    if (!tokenManager.addToken(key1)) printStateError(tokenManager);
     std::cout << ">>> 系統初始化完成，防禦系統啟動 <<<\n";
 
-    // 4. 主循環
+    // 5. 主循環
     std::string inputToken;
     while (true) {
         std::cout << "WAITING_FOR_TOKEN\n" << std::flush; // 關鍵訊號
@@ -126,6 +114,7 @@ int main() {
             std::cout << "[DENY] 驗證失敗 (Token無效)，累計攻擊次數 " 
                       << tokenManager.getAttackCount() << "\n";
         }
+        printStateError(tokenManager);
     }
 
     return 0;
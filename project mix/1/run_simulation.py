@@ -83,6 +83,11 @@ def compile_cpp():
     if subprocess.call(["g++", "defend_1.cpp", "-o", "defend_1"], shell=shell_cmd) != 0:
         print(f"{Colors.RED}[ERROR] defend_1.cpp 編譯失敗。{Colors.RESET}")
         return False
+
+    # 持久化狀態的當機注入 / 回復時間測試 (不在演練中執行，見 state_test.cpp 開頭用法)
+    if subprocess.call(["g++", "state_test.cpp", "-o", "state_test"], shell=shell_cmd) != 0:
+        print(f"{Colors.RED}[ERROR] state_test.cpp 編譯失敗。{Colors.RESET}")
+        return False
         
     print(f"{Colors.GREEN}[SYSTEM] 編譯完成！準備開始演練...{Colors.RESET}\n")
     return True
@@ -101,6 +106,11 @@ def run_demo():
         defend_exec = "./defend_1"
         SYS_ENCODING = 'utf-8'
 
+    # 每次演練都從乾淨的防禦狀態開始 (defend_1 會保留上次的 token 與鎖定)
+    for f in ["defense_state.snap", "defense_state.wal"]:
+        if os.path.exists(f):
+            os.remove(f)
+
     try:
         # 1. 啟動藍隊
         defend_process = subprocess.Popen(
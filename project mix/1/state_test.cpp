@@ -0,0 +1,470 @@
+// 防禦程式持久化狀態的當機注入測試與回復時間測試
+// 編譯: g++ state_test.cpp -o state_test   (run_simulation.py 會一併編譯)
+// 用法: state_test                                         執行兩個防禦程式的當機注入測試
+//       state_test --bench-recovery <快照 token 筆數> [日誌尾端筆數]
+// 測試只使用 crash_* / bench_* 開頭的狀態檔與記錄檔，
+// 不會碰到正式的 defense_state.*、defense_log.txt 與 user_state.*
+#include <iostream>
+#include <string>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#include "token_store.h"
+#include "../../user_state.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+std::string readAll(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+void writeAll(const std::string& path, const std::string& data) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+}
+
+// 以同名目錄佔住路徑，寫入或 rename 到該路徑都會失敗
+// (佔住快照暫存檔即可讓壓縮失敗)
+void blockPath(const std::string& path, bool on) {
+#ifdef _WIN32
+    if (on) _mkdir(path.c_str());
+    else _rmdir(path.c_str());
+#else
+    if (on) mkdir(path.c_str(), 0755);
+    else rmdir(path.c_str());
+#endif
+}
+
+bool exists(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return in.good();
+}
+
+void removeState(const std::string& prefix) {
+    blockPath(prefix + ".snap.tmp", false);
+    blockPath(prefix + ".snap.corrupt", false);
+    std::remove((prefix + ".snap.tmp").c_str());
+    std::remove((prefix + ".snap.corrupt").c_str());
+    std::remove((prefix + ".snap").c_str());
+    std::remove((prefix + ".wal").c_str());
+    std::remove((prefix + ".log").c_str());
+}
+
+// 兩個防禦程式的測試情境相同：
+// 1. 把日誌最後一筆記錄截斷在每個位元組位置、或竄改其中任一位元組，
+//    還原後須等於前一筆完整記錄，且之後追加的記錄重啟後仍在；
+//    每種情況都再跑一次「還原時壓縮失敗」
+// 2. 壓縮時快照已 rename、日誌尚未清空就當機：重播已併入快照的記錄不得改變狀態
+// 3. 快照暫存檔寫到一半就當機：還原時忽略，下次壓縮照常成功
+// 4. 快照損毀：移到 .snap.corrupt 保留原始內容、從日誌還原；移不走時不得壓縮覆蓋
+// defend_1 另外檢查快照與日誌裡只有 token 的 SHA-256 摘要，沒有明文
+
+// ===== defend_1：TokenManager =====
+namespace tokens {
+
+const std::string prefix = "crash_state";
+const std::string snapFile = prefix + ".snap";
+const std::string walFile = prefix + ".wal";
+const std::string logFile = prefix + ".log";   // 不寫入正式的 defense_log.txt
+
+bool matches(TokenManager& tm, const std::vector<std::string>& present, const std::string& absent, int attacks) {
+    for (const std::string& t : present) {
+        if (!tm.hasToken(t)) return false;
+    }
+    if (!absent.empty() && tm.hasToken(absent)) return false;
+    return tm.getAttackCount() == attacks;
+}
+
+// 建立 token 與攻擊記錄交錯的日誌
+void populate(TokenManager& tm, std::vector<std::string>& added, int& attacks) {
+    for (int i = 0; i < 3; i++) {
+        added.push_back("crash_tok_" + std::to_string(i));
+        tm.addToken(added.back());
+        tm.validateToken("crash_bad_" + std::to_string(i));
+        attacks++;
+    }
+}
+
+int tornTail(bool lastIsToken) {
+    removeState(prefix);
+    std::vector<std::string> added;
+    int attacks = 0;
+    {
+        TokenManager tm(prefix, logFile);
+        tm.restore();
+        populate(tm, added, attacks);
+    }
+    size_t lastRecordStart = readAll(walFile).size();
+    const std::string lastToken = lastIsToken ? "crash_last" : "";
+    {
+        TokenManager tm(prefix, logFile);
+        tm.restore();
+        if (lastIsToken) tm.addToken(lastToken);
+        else tm.validateToken("crash_bad_last");
+    }
+    const std::string full = readAll(walFile);
+
+    int cases = 0, failures = 0;
+    for (size_t pos = lastRecordStart; pos < full.size(); pos++) {
+        for (int mode = 0; mode < 4; mode++) {
+            bool corrupt = mode & 1, failCompact = mode & 2;
+            std::string data = corrupt ? full : full.substr(0, pos);
+            if (corrupt) data[pos] ^= 0x5A;
+            removeState(prefix);
+            writeAll(walFile, data);
+
+            bool ok;
+            blockPath(snapFile + ".tmp", failCompact);
+            {
+                TokenManager tm(prefix, logFile);
+                tm.restore();
+                ok = matches(tm, added, lastToken, attacks);
+                tm.addToken("crash_after");
+            }
+            blockPath(snapFile + ".tmp", false);
+            TokenManager again(prefix, logFile);
+            again.restore();
+            ok = ok && again.hasToken("crash_after") && matches(again, added, lastToken, attacks);
+
+            cases++;
+            if (!ok) {
+                failures++;
+                std::cout << "  FAIL: " << (corrupt ? "竄改" : "截斷") << "於位元組 " << pos
+                          << (failCompact ? " (壓縮失敗)" : "") << "\n";
+            }
+        }
+    }
+    std::cout << "defend_1 日誌最後一筆為" << (lastIsToken ? "新增 token" : "攻擊次數")
+              << "：截斷/竄改 " << cases << " 種情況，失敗 " << failures << "\n";
+    return failures;
+}
+
+int interruptedCompaction() {
+    removeState(prefix);
+    std::vector<std::string> added;
+    int attacks = 0;
+    std::string journalBeforeCompact;
+    {
+        TokenManager tm(prefix, logFile);
+        tm.restore();
+        populate(tm, added, attacks);
+        journalBeforeCompact = readAll(walFile);
+        tm.compact();
+    }
+    writeAll(walFile, journalBeforeCompact);   // 快照已換新但日誌未清空
+
+    int failures = 0;
+    {
+        TokenManager tm(prefix, logFile);
+        TokenManager::RecoveryStats stats = tm.restore();
+        bool ok = stats.snapshotTokens == added.size() && stats.replayedRecords > 0
+               && matches(tm, added, "", attacks);
+        std::cout << "defend_1 壓縮中途當機 (rename 後、清空日誌前)：" << (ok ? "OK" : "FAIL") << "\n";
+        if (!ok) failures++;
+    }
+
+    writeAll(snapFile + ".tmp", "half-written snapshot");
+    {
+        TokenManager tm(prefix, logFile);
+        tm.restore();
+        bool ok = matches(tm, added, "", attacks) && tm.compact();
+        std::cout << "defend_1 快照暫存檔寫到一半當機：" << (ok ? "OK" : "FAIL") << "\n";
+        if (!ok) failures++;
+    }
+    TokenManager again(prefix, logFile);
+    again.restore();
+    if (!matches(again, added, "", attacks)) {
+        std::cout << "  FAIL: 重新壓縮後狀態不符\n";
+        failures++;
+    }
+    return failures;
+}
+
+// 寫出快照 (含 added 與攻擊次數) 後再追加一筆只在日誌裡的 token，回傳竄改檔頭後的快照內容
+std::string writeCorruptSnapshot(std::vector<std::string>& added, int& attacks) {
+    removeState(prefix);
+    {
+        TokenManager tm(prefix, logFile);
+        tm.restore();
+        populate(tm, added, attacks);
+        tm.compact();
+        tm.addToken("crash_journal_only");
+    }
+    std::string corrupt = readAll(snapFile);
+    corrupt[sizeof(state::SNAP_MAGIC)] ^= 0x5A;   // 攻擊次數欄位，檔頭校驗碼不符
+    writeAll(snapFile, corrupt);
+    return corrupt;
+}
+
+int corruptSnapshot() {
+    std::vector<std::string> added;
+    int attacks = 0, failures = 0;
+    std::string corrupt = writeCorruptSnapshot(added, attacks);
+    {
+        TokenManager tm(prefix, logFile);
+        TokenManager::RecoveryStats stats = tm.restore();
+        bool ok = stats.snapshotCorrupt && tm.takeStateError().empty()
+               && !exists(snapFile) && readAll(snapFile + ".corrupt") == corrupt
+               && tm.hasToken("crash_journal_only") && !tm.hasToken(added[0])
+               && tm.compact();
+        std::cout << "defend_1 快照損毀 (移至 .corrupt、從日誌還原)：" << (ok ? "OK" : "FAIL") << "\n";
+        if (!ok) failures++;
+    }
+    TokenManager again(prefix, logFile);
+    TokenManager::RecoveryStats stats = again.restore();
+    if (stats.snapshotCorrupt || !again.hasToken("crash_journal_only")) {
+        std::cout << "  FAIL: 重新壓縮後狀態不符\n";
+        failures++;
+    }
+
+    added.clear();
+    attacks = 0;
+    corrupt = writeCorruptSnapshot(added, attacks);
+    blockPath(snapFile + ".corrupt", true);
+    {
+        TokenManager tm(prefix, logFile);
+        TokenManager::RecoveryStats stats = tm.restore();
+        bool ok = stats.snapshotCorrupt && !tm.takeStateError().empty()
+               && tm.hasToken("crash_journal_only") && !tm.compact()
+               && readAll(snapFile) == corrupt;
+        std::cout << "defend_1 快照損毀且無法移走 (不得覆蓋)：" << (ok ? "OK" : "FAIL") << "\n";
+        if (!ok) failures++;
+    }
+    blockPath(snapFile + ".corrupt", false);
+    return failures;
+}
+
+std::string hex(const std::string& bytes) {
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    for (unsigned char c : bytes) {
+        out += digits[c >> 4];
+        out += digits[c & 15];
+    }
+    return out;
+}
+
+int digestOnly() {
+    // FIPS 180-2 範例：空字串、"abc"、兩個區塊的 56 字元訊息
+    bool ok = hex(state::tokenDigest("")) == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"
+           && hex(state::tokenDigest("abc")) == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"
+           && hex(state::tokenDigest("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"))
+              == "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1";
+
+    removeState(prefix);
+    {
+        TokenManager tm(prefix, logFile);
+        tm.restore();
+        tm.addToken("crash_secret_snap");
+        ok = tm.compact() && ok;
+        tm.addToken("crash_secret_wal");
+    }
+    std::string files = readAll(snapFile) + readAll(walFile);
+    ok = ok && files.find("crash_secret") == std::string::npos;
+    TokenManager again(prefix, logFile);
+    again.restore();
+    ok = ok && again.hasToken("crash_secret_snap") && again.hasToken("crash_secret_wal");
+    std::cout << "defend_1 狀態檔只存 SHA-256 摘要：" << (ok ? "OK" : "FAIL") << "\n";
+    return ok ? 0 : 1;
+}
+
+int run() {
+    int failures = tornTail(true) + tornTail(false) + interruptedCompaction() + corruptSnapshot() + digestOnly();
+    removeState(prefix);
+    return failures;
+}
+
+// 回復時間：快照 tokenCount 筆 + 日誌尾端 tailCount 筆
+int benchRecovery(size_t tokenCount, size_t tailCount) {
+    const std::string benchPrefix = "bench_state";
+    removeState(benchPrefix);
+
+    std::vector<std::string> digests;
+    std::vector<state::TokenRef> refs;
+    digests.reserve(tokenCount);
+    refs.reserve(tokenCount);
+    for (size_t i = 0; i < tokenCount; i++) digests.push_back(state::tokenDigest("bench_tok_" + std::to_string(i)));
+    for (auto& d : digests) refs.push_back({d.data(), d.size()});
+    if (!state::Snapshot::write(benchPrefix + ".snap", 0, refs)) {
+        std::cout << "無法寫入快照\n";
+        return 1;
+    }
+    {
+        TokenManager writer(benchPrefix, benchPrefix + ".log");
+        writer.restore();
+        for (size_t i = 0; i < tailCount; i++) writer.addToken("bench_tail_" + std::to_string(i));
+    }
+
+    TokenManager tokenManager(benchPrefix, benchPrefix + ".log");
+    TokenManager::RecoveryStats stats = tokenManager.restore();
+    bool ok = (tokenCount == 0 || tokenManager.hasToken("bench_tok_" + std::to_string(tokenCount - 1)))
+           && (tailCount == 0 || tokenManager.hasToken("bench_tail_" + std::to_string(tailCount - 1)));
+
+    std::cout << "快照 token: " << stats.snapshotTokens
+              << " | 重播日誌: " << stats.replayedRecords
+              << " | 回復時間: " << stats.millis << " ms"
+              << " | 查詢驗證: " << (ok ? "OK" : "FAIL") << "\n";
+
+    removeState(benchPrefix);
+    return ok ? 0 : 1;
+}
+
+} // namespace tokens
+
+// ===== project_2_defend：UserStateStore =====
+namespace users {
+
+const std::string prefix = "crash_user_state";
+const std::string snapFile = prefix + ".snap";
+const std::string walFile = prefix + ".wal";
+
+// 模擬程式重啟：關掉日誌、從初始狀態重新載入，回傳 user_state_load 的旗標
+int reopen(UserStateStore& store, UserStatus& u) {
+    user_state_close(&store);
+    std::memset(&u, 0, sizeof(u));
+    std::strcpy(u.username, "student1");
+    user_state_init(&store, prefix.c_str());
+    return user_state_load(&store, &u);
+}
+
+void saveFailCount(UserStateStore& store, UserStatus& u, int failCount) {
+    u.fail_count = failCount;
+    user_state_save(&store, &u);
+}
+
+int tornTail(UserStateStore& store) {
+    UserStatus u;
+    removeState(prefix);
+    reopen(store, u);
+    for (int i = 1; i <= 4; i++) saveFailCount(store, u, i);
+    size_t lastRecordStart = readAll(walFile).size();
+    u.fail_count = 5;
+    u.block_until = time(NULL) + 300;
+    user_state_save(&store, &u);
+    user_state_close(&store);
+    const std::string full = readAll(walFile);
+
+    int cases = 0, failures = 0;
+    for (size_t pos = lastRecordStart; pos < full.size(); pos++) {
+        for (int mode = 0; mode < 4; mode++) {
+            bool corrupt = mode & 1, failCompact = mode & 2;
+            std::string data = corrupt ? full : full.substr(0, pos);
+            if (corrupt) data[pos] ^= 0x5A;
+            removeState(prefix);
+            writeAll(walFile, data);
+
+            blockPath(snapFile + ".tmp", failCompact);
+            reopen(store, u);
+            bool ok = u.fail_count == 4 && u.block_until == 0;
+            saveFailCount(store, u, 9);
+            blockPath(snapFile + ".tmp", false);
+            reopen(store, u);
+            ok = ok && u.fail_count == 9;
+
+            cases++;
+            if (!ok) {
+                failures++;
+                std::cout << "  FAIL: " << (corrupt ? "竄改" : "截斷") << "於位元組 " << pos
+                          << (failCompact ? " (壓縮失敗)" : "") << "\n";
+            }
+        }
+    }
+    std::cout << "project_2_defend 日誌最後一筆截斷/竄改：" << cases << " 種情況，失敗 " << failures << "\n";
+    return failures;
+}
+
+int interruptedCompaction(UserStateStore& store) {
+    UserStatus u;
+    int failures = 0;
+    removeState(prefix);
+    reopen(store, u);
+    for (int i = 1; i <= 3; i++) saveFailCount(store, u, i);
+    std::string journalBeforeCompact = readAll(walFile);
+    bool ok = user_state_compact(&store, &u);
+    user_state_close(&store);
+    writeAll(walFile, journalBeforeCompact);   // 快照已換新但日誌未清空
+    reopen(store, u);
+    ok = ok && u.fail_count == 3;
+    std::cout << "project_2_defend 壓縮中途當機 (rename 後、清空日誌前)：" << (ok ? "OK" : "FAIL") << "\n";
+    if (!ok) failures++;
+
+    writeAll(snapFile + ".tmp", "half");
+    reopen(store, u);
+    ok = u.fail_count == 3 && user_state_compact(&store, &u);
+    reopen(store, u);
+    ok = ok && u.fail_count == 3;
+    std::cout << "project_2_defend 快照暫存檔寫到一半當機：" << (ok ? "OK" : "FAIL") << "\n";
+    if (!ok) failures++;
+    return failures;
+}
+
+// 快照記錄失敗次數 3，日誌再記一筆 4；回傳竄改後的快照內容
+std::string writeCorruptSnapshot(UserStateStore& store) {
+    UserStatus u;
+    removeState(prefix);
+    reopen(store, u);
+    for (int i = 1; i <= 3; i++) saveFailCount(store, u, i);
+    user_state_compact(&store, &u);
+    saveFailCount(store, u, 4);
+    user_state_close(&store);
+    std::string corrupt = readAll(snapFile);
+    corrupt[0] ^= 0x5A;
+    writeAll(snapFile, corrupt);
+    return corrupt;
+}
+
+int corruptSnapshot(UserStateStore& store) {
+    UserStatus u;
+    int failures = 0;
+    std::string corrupt = writeCorruptSnapshot(store);
+    int flags = reopen(store, u);
+    bool ok = (flags & USER_STATE_SNAPSHOT_CORRUPT) && !store.snapshot_locked
+           && !exists(snapFile) && readAll(snapFile + ".corrupt") == corrupt
+           && u.fail_count == 4 && user_state_compact(&store, &u);
+    reopen(store, u);
+    ok = ok && u.fail_count == 4;
+    std::cout << "project_2_defend 快照損毀 (移至 .corrupt、從日誌還原)：" << (ok ? "OK" : "FAIL") << "\n";
+    if (!ok) failures++;
+
+    corrupt = writeCorruptSnapshot(store);
+    blockPath(snapFile + ".corrupt", true);
+    flags = reopen(store, u);
+    ok = (flags & USER_STATE_SNAPSHOT_CORRUPT) && store.snapshot_locked
+         && u.fail_count == 4 && !user_state_compact(&store, &u) && readAll(snapFile) == corrupt;
+    std::cout << "project_2_defend 快照損毀且無法移走 (不得覆蓋)：" << (ok ? "OK" : "FAIL") << "\n";
+    if (!ok) failures++;
+    user_state_close(&store);
+    blockPath(snapFile + ".corrupt", false);
+    return failures;
+}
+
+int run() {
+    UserStateStore store;
+    user_state_init(&store, prefix.c_str());
+    int failures = tornTail(store) + interruptedCompaction(store) + corruptSnapshot(store);
+    user_state_close(&store);
+    removeState(prefix);
+    return failures;
+}
+
+} // namespace users
+
+int main(int argc, char* argv[]) {
+    #ifdef _WIN32
+    SetConsoleOutputCP(65001);
+    #endif
+
+    if (argc >= 3 && std::string(argv[1]) == "--bench-recovery") {
+        return tokens::benchRecovery(std::stoul(argv[2]), argc >= 4 ? std::stoul(argv[3]) : 1000);
+    }
+
+    int failures = tokens::run() + users::run();
+    std::cout << (failures == 0 ? "當機注入測試通過\n" : "當機注入測試失敗\n");
+    return failures == 0 ? 0 : 1;
+}
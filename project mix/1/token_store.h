@@ -0,0 +1,514 @@
+// defend_1 的持久化狀態 (token 與攻擊次數)
+#ifndef TOKEN_STORE_H
+#define TOKEN_STORE_H
+
+#include <string>
+#include <unordered_map>
+#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "../../state_file.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// ===== 持久化狀態：預寫日誌 (WAL) + 可映射快照 =====
+// 每次 token / 攻擊次數變動先寫入日誌 (含校驗碼並 fsync)，累積一定筆數後壓縮成快照。
+// 快照 = Header | Slot[slotCount] | token 摘要區，Slot 為開放定址雜湊表，
+// 重啟時直接 mmap 原地查詢，只需重播快照之後的日誌尾端，不必逐筆重建。
+// 日誌與快照只存 token 的 SHA-256 摘要，檔案外流也看不到管理者密鑰明文。
+namespace state {
+
+constexpr char SNAP_MAGIC[8] = {'T', 'K', 'S', 'N', 'A', 'P', '0', '3'};
+
+struct SnapshotHeader {
+    char magic[8];
+    int32_t attackCount;
+    uint32_t checksum;    // 檔頭其餘欄位的校驗碼
+    uint64_t tokenCount;
+    uint64_t slotCount;   // 2 的次方
+    uint64_t blobSize;
+};
+
+struct Slot {
+    uint64_t hash;        // 0 代表空位
+    uint64_t offset;      // 在摘要區中的位置
+    uint32_t length;
+    uint32_t reserved;
+};
+
+enum RecordType : uint8_t { REC_ADD_TOKEN = 1, REC_ATTACK_COUNT = 2 };
+
+struct RecordHeader {
+    uint32_t checksum;    // 涵蓋 type 之後的欄位與 payload
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t length;      // payload 長度
+    int32_t value;        // 攻擊次數記錄的是絕對值，重播可重複套用
+};
+
+struct TokenRef {
+    const char* data;
+    size_t length;
+};
+
+inline uint64_t hashToken(const char* data, size_t length) {
+    uint64_t h = state_fnv64(1469598103934665603ULL, data, length);
+    return h ? h : 1;
+}
+
+const size_t DIGEST_SIZE = 32;
+
+// SHA-256 (FIPS 180-4)，回傳 32 位元組的摘要
+inline std::string tokenDigest(const std::string& token) {
+    static const uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t hs[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+
+    // 補位：0x80、補零到 56 (mod 64)，最後 8 位元組為位元長度 (big-endian)
+    std::string msg = token;
+    uint64_t bits = (uint64_t)token.size() * 8;
+    msg += (char)0x80;
+    while (msg.size() % 64 != 56) msg += (char)0;
+    for (int i = 7; i >= 0; i--) msg += (char)(bits >> (i * 8));
+
+    for (size_t block = 0; block < msg.size(); block += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            const unsigned char* b = (const unsigned char*)msg.data() + block + i * 4;
+            w[i] = (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 8 | b[3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = hs[0], b = hs[1], c = hs[2], d = hs[3], e = hs[4], f = hs[5], g = hs[6], h = hs[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        hs[0] += a; hs[1] += b; hs[2] += c; hs[3] += d;
+        hs[4] += e; hs[5] += f; hs[6] += g; hs[7] += h;
+    }
+
+    std::string digest(DIGEST_SIZE, '\0');
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 4; j++) digest[i * 4 + j] = (char)(hs[i] >> (24 - j * 8));
+    }
+    return digest;
+}
+
+inline uint32_t recordChecksum(const RecordHeader& h, const char* payload) {
+    uint32_t c = state_fnv32(STATE_FNV32_INIT, &h.type, sizeof(h) - sizeof(h.checksum));
+    return state_fnv32(c, payload, h.length);
+}
+
+inline uint32_t headerChecksum(const SnapshotHeader& h) {
+    SnapshotHeader copy = h;
+    copy.checksum = 0;
+    return state_fnv32(STATE_FNV32_INIT, &copy, sizeof(copy));
+}
+
+// 唯讀記憶體映射
+class MappedFile {
+private:
+    const char* base = nullptr;
+    size_t length = 0;
+
+public:
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& path) {
+        close();
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                                  NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER size;
+        HANDLE mapping = NULL;
+        if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+            mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        }
+        if (mapping != NULL) {
+            base = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            length = base ? (size_t)size.QuadPart : 0;
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                base = (const char*)p;
+                length = (size_t)st.st_size;
+            }
+        }
+        ::close(fd);
+#endif
+        return base != nullptr;
+    }
+
+    void close() {
+        if (!base) return;
+#ifdef _WIN32
+        UnmapViewOfFile(base);
+#else
+        munmap((void*)base, length);
+#endif
+        base = nullptr;
+        length = 0;
+    }
+
+    const char* data() const { return base; }
+    size_t size() const { return length; }
+};
+
+class Snapshot {
+private:
+    MappedFile file;
+    const SnapshotHeader* header = nullptr;
+    const Slot* slots = nullptr;
+    const char* blob = nullptr;
+
+public:
+    enum LoadResult { MISSING, LOADED, INVALID };
+
+    // 載入時只驗證檔頭 (校驗碼與大小，避免逐筆掃描拖慢重啟)；
+    // 各 Slot 的 offset/length 在每次存取時檢查，損毀的快照不會讀出映射範圍
+    LoadResult load(const std::string& path) {
+        unload();
+        if (!file.open(path)) {
+            // 檔案存在卻無法映射 (例如長度為 0) 也算損毀
+            FILE* f = std::fopen(path.c_str(), "rb");
+            if (!f) return MISSING;
+            std::fclose(f);
+            return INVALID;
+        }
+        const SnapshotHeader* h = (const SnapshotHeader*)file.data();
+        uint64_t body = file.size() - sizeof(SnapshotHeader);
+        bool ok = file.size() >= sizeof(SnapshotHeader)
+               && std::memcmp(h->magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) == 0
+               && h->checksum == headerChecksum(*h)
+               && h->slotCount > 0 && (h->slotCount & (h->slotCount - 1)) == 0
+               && h->slotCount <= body / sizeof(Slot)
+               && h->blobSize == body - h->slotCount * sizeof(Slot);
+        if (!ok) {
+            file.close();
+            return INVALID;
+        }
+        header = h;
+        slots = (const Slot*)(file.data() + sizeof(SnapshotHeader));
+        blob = (const char*)(slots + h->slotCount);
+        return LOADED;
+    }
+
+    void unload() {
+        file.close();
+        header = nullptr;
+        slots = nullptr;
+        blob = nullptr;
+    }
+
+    bool validSlot(const Slot& s) const {
+        return s.hash != 0 && s.offset <= header->blobSize && s.length <= header->blobSize - s.offset;
+    }
+
+    bool contains(const std::string& digest) const {
+        if (!header) return false;
+        uint64_t h = hashToken(digest.data(), digest.size());
+        uint64_t mask = header->slotCount - 1;
+        uint64_t i = h & mask;
+        for (uint64_t probes = 0; probes < header->slotCount && slots[i].hash != 0; probes++) {
+            const Slot& s = slots[i];
+            if (s.hash == h && s.length == digest.size() && validSlot(s)
+                && std::memcmp(blob + s.offset, digest.data(), s.length) == 0) {
+                return true;
+            }
+            i = (i + 1) & mask;
+        }
+        return false;
+    }
+
+    void collect(std::vector<TokenRef>& out) const {
+        if (!header) return;
+        for (uint64_t i = 0; i < header->slotCount; i++) {
+            if (validSlot(slots[i])) out.push_back({blob + slots[i].offset, slots[i].length});
+        }
+    }
+
+    int attackCount() const { return header ? header->attackCount : 0; }
+    uint64_t tokenCount() const { return header ? header->tokenCount : 0; }
+
+    static bool write(const std::string& path, int attackCount, const std::vector<TokenRef>& tokens) {
+        uint64_t slotCount = 16;
+        while (slotCount < tokens.size() * 2) slotCount <<= 1;
+
+        SnapshotHeader h;
+        std::memcpy(h.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+        h.attackCount = attackCount;
+        h.checksum = 0;
+        h.tokenCount = tokens.size();
+        h.slotCount = slotCount;
+        h.blobSize = 0;
+
+        std::vector<Slot> table(slotCount, Slot{0, 0, 0, 0});
+        for (const TokenRef& t : tokens) {
+            uint64_t hash = hashToken(t.data, t.length);
+            uint64_t i = hash & (slotCount - 1);
+            while (table[i].hash != 0) i = (i + 1) & (slotCount - 1);
+            table[i] = Slot{hash, h.blobSize, (uint32_t)t.length, 0};
+            h.blobSize += t.length;
+        }
+        h.checksum = headerChecksum(h);
+
+        FILE* f = std::fopen(path.c_str(), "wb");
+        if (!f) return false;
+        bool ok = std::fwrite(&h, sizeof(h), 1, f) == 1
+               && std::fwrite(table.data(), sizeof(Slot), table.size(), f) == table.size();
+        for (size_t i = 0; ok && i < tokens.size(); i++) {
+            ok = std::fwrite(tokens[i].data, 1, tokens[i].length, f) == tokens[i].length;
+        }
+        ok = ok && state_sync_file(f);
+        return std::fclose(f) == 0 && ok;
+    }
+};
+
+} // namespace state
+
+class TokenManager {
+private:
+    std::unordered_map<std::string, bool> validTokens;   // 最新快照之後新增的 token 摘要
+    int attackCount = 0;
+    const int attackThreshold = 5; 
+    const std::string logFile;
+    const std::string snapshotFile;
+    const std::string journalFile;
+    const size_t compactMinRecords = 1024;   // 日誌至少累積這麼多筆才壓縮
+
+    state::Snapshot snapshot;
+    FILE* journal = nullptr;
+    size_t journalRecords = 0;
+    long long journalBytes = 0;   // 最後一筆成功寫入記錄的結尾位置
+    std::string stateError;       // 尚未交給呼叫端顯示的持久化錯誤
+    bool snapshotLocked = false;  // 損毀的快照無法移走，不可壓縮覆蓋
+
+    void logAttack(const std::string& detail) {
+        std::ofstream logStream(logFile, std::ios::app);
+        if (logStream.is_open()) {
+            logStream << detail << std::endl;
+            logStream.close();
+        }
+    }
+
+    void applyRecord(const state::RecordHeader& h, const std::string& payload) {
+        if (h.type == state::REC_ADD_TOKEN && payload.size() == state::DIGEST_SIZE) {
+            if (!snapshot.contains(payload)) validTokens[payload] = true;
+        } else if (h.type == state::REC_ATTACK_COUNT) {
+            attackCount = h.value;
+        }
+    }
+
+    void reportStateError(const std::string& detail) {
+        if (!stateError.empty()) stateError += "；";
+        stateError += detail;
+        logAttack("[錯誤] " + detail);
+    }
+
+    // 先寫日誌再回應，確保回應過的狀態重啟後仍在；
+    // 寫入失敗時回傳 false 並記下錯誤，由呼叫端透過 takeStateError 顯示
+    bool journalAppend(uint8_t type, int32_t value, const std::string& payload) {
+        if (!journal) {
+            reportStateError("狀態日誌未開啟，這次變動重啟後不會保留");
+            return false;
+        }
+        state::RecordHeader h;
+        h.type = type;
+        h.reserved = 0;
+        h.length = (uint16_t)(std::min)(payload.size(), (size_t)UINT16_MAX);
+        h.value = value;
+        h.checksum = state::recordChecksum(h, payload.data());
+
+        std::string record((const char*)&h, sizeof(h));
+        record.append(payload, 0, h.length);
+        if (std::fwrite(record.data(), 1, record.size(), journal) != record.size()
+            || !state_sync_file(journal)) {
+            // 撤掉寫了一半的記錄，避免之後的記錄接在殘缺資料後面
+            std::fclose(journal);
+            journal = nullptr;
+            if (state_truncate_file(journalFile.c_str(), journalBytes)) {
+                journal = std::fopen(journalFile.c_str(), "ab");
+            }
+            reportStateError("狀態日誌寫入失敗，這次變動重啟後不會保留");
+            return false;
+        }
+        journalBytes += record.size();
+
+        // 日誌與快照維持固定比例，壓縮成本攤提到每筆記錄上
+        if (++journalRecords >= std::max<uint64_t>(compactMinRecords, snapshot.tokenCount() / 4)
+            && !compact()) {
+            reportStateError("快照壓縮失敗，狀態仍保留在日誌中");
+        }
+        return true;
+    }
+
+public:
+    struct RecoveryStats {
+        uint64_t snapshotTokens = 0;
+        size_t replayedRecords = 0;
+        bool tornTail = false;
+        bool snapshotCorrupt = false;   // 快照存在但驗證失敗，已移到 .corrupt
+        double millis = 0;
+    };
+
+    explicit TokenManager(const std::string& statePrefix = "defense_state",
+                          const std::string& logPath = "defense_log.txt")
+        : logFile(logPath), snapshotFile(statePrefix + ".snap"), journalFile(statePrefix + ".wal") {}
+
+    ~TokenManager() {
+        if (journal) std::fclose(journal);
+    }
+
+    // 映射最新快照並重播日誌尾端；日誌尾端若因當機而殘缺，截斷殘缺部分後立即壓縮。
+    // 快照損毀時移到 <快照>.corrupt 保留原始內容，只從日誌還原；
+    // 移不走就停止壓縮，避免新快照覆蓋掉它
+    RecoveryStats restore() {
+        RecoveryStats stats;
+        auto start = std::chrono::steady_clock::now();
+
+        state::Snapshot::LoadResult loaded = snapshot.load(snapshotFile);
+        if (loaded == state::Snapshot::LOADED) {
+            attackCount = snapshot.attackCount();
+        } else if (loaded == state::Snapshot::INVALID) {
+            std::string aside = snapshotFile + ".corrupt";
+            stats.snapshotCorrupt = true;
+            logAttack("[錯誤] 快照 " + snapshotFile + " 驗證失敗，已移至 " + aside + "，僅從日誌還原");
+            if (!state_replace_file(snapshotFile.c_str(), aside.c_str())) {
+                snapshotLocked = true;
+                reportStateError("無法移走損毀的快照，暫停壓縮");
+            }
+        }
+        stats.snapshotTokens = snapshot.tokenCount();
+
+        long long goodBytes = 0;
+        if (FILE* f = std::fopen(journalFile.c_str(), "rb")) {
+            state::RecordHeader h;
+            std::string payload;
+            while (true) {
+                size_t n = std::fread(&h, 1, sizeof(h), f);
+                if (n == 0) break;
+                payload.resize(n == sizeof(h) ? h.length : 0);
+                if (n != sizeof(h)
+                    || std::fread(&payload[0], 1, payload.size(), f) != payload.size()
+                    || state::recordChecksum(h, payload.data()) != h.checksum) {
+                    stats.tornTail = true;
+                    break;
+                }
+                applyRecord(h, payload);
+                stats.replayedRecords++;
+                goodBytes += sizeof(h) + payload.size();
+            }
+            std::fclose(f);
+        }
+        journalRecords = stats.replayedRecords;
+        journalBytes = goodBytes;
+
+        // 不論之後壓縮是否成功都先截斷；截斷失敗就不再追加，等壓縮重建日誌
+        if (!stats.tornTail || state_truncate_file(journalFile.c_str(), goodBytes)) {
+            journal = std::fopen(journalFile.c_str(), "ab");
+        }
+        if (stats.tornTail && !compact()) reportStateError("快照壓縮失敗，狀態仍保留在日誌中");
+
+        stats.millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return stats;
+    }
+
+    // 將快照與新增 token 合併寫成新快照，並清空日誌
+    bool compact() {
+        if (snapshotLocked) return false;
+        std::vector<state::TokenRef> tokens;
+        tokens.reserve(snapshot.tokenCount() + validTokens.size());
+        snapshot.collect(tokens);
+        for (auto& p : validTokens) {
+            if (p.second) tokens.push_back({p.first.data(), p.first.size()});
+        }
+
+        // 先完整寫入暫存檔再 rename，當機時舊快照仍然完整；
+        // Windows 無法取代仍在映射中的檔案，rename 前需先卸載舊快照
+        std::string tmp = snapshotFile + ".tmp";
+        if (!state::Snapshot::write(tmp, attackCount, tokens)) return false;
+        snapshot.unload();
+        bool replaced = state_replace_file(tmp.c_str(), snapshotFile.c_str());
+        bool loaded = snapshot.load(snapshotFile) == state::Snapshot::LOADED;
+        if (!replaced || !loaded) return false;
+
+        validTokens.clear();
+        if (journal) std::fclose(journal);
+        journal = std::fopen(journalFile.c_str(), "wb");
+        journalRecords = 0;
+        journalBytes = 0;
+        return journal != nullptr;
+    }
+
+    bool hasDigest(const std::string& digest) {
+        auto it = validTokens.find(digest);
+        if (it != validTokens.end()) return it->second;
+        return snapshot.contains(digest);
+    }
+
+    bool hasToken(const std::string& token) { return hasDigest(state::tokenDigest(token)); }
+
+    // 回傳 false 代表 token 本次有效，但未寫入日誌，重啟後不會保留
+    bool addToken(const std::string& token) {
+        std::string digest = state::tokenDigest(token);
+        if (hasDigest(digest)) return true;
+        validTokens[digest] = true;
+        return journalAppend(state::REC_ADD_TOKEN, 0, digest);
+    }
+
+    int validateToken(const std::string& token) {
+        if (hasToken(token)) {
+            return 0; 
+        } else {
+            attackCount++;
+            journalAppend(state::REC_ATTACK_COUNT, attackCount, "");
+            logAttack("[警告] 惡意攻擊: 使用 token " + token + " | 攻擊次數: " + std::to_string(attackCount));
+            if (attackCount >= attackThreshold) return 2;
+            return 1;
+        }
+    }
+
+    // 取出並清除最近一次的持久化錯誤，沒有錯誤時回傳空字串
+    std::string takeStateError() {
+        std::string detail;
+        detail.swap(stateError);
+        return detail;
+    }
+
+    bool isBlocked() { return attackCount >= attackThreshold; }
+    int getAttackCount() { return attackCount; }
+    int getThreshold() { return attackThreshold; }
+};
+
+#endif
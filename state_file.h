@@ -0,0 +1,91 @@
+// 持久化狀態共用的檔案操作 (C / C++ 皆可引入)
+// defend_1 (project mix/1/token_store.h) 與 project_2_defend (user_state.h) 的
+// 預寫日誌 (WAL) 與快照都建立在這幾個函式上：
+// 記錄先寫入並 fsync 才算數；當機留下的殘缺尾端在重啟時截斷；
+// 快照一律先寫暫存檔再 rename 取代，當機時舊快照仍然完整。
+#ifndef STATE_FILE_H
+#define STATE_FILE_H
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// 確保資料落地，避免斷電後日誌或快照只寫了一半
+static inline int state_sync_file(FILE* f) {
+    if (fflush(f) != 0) return 0;
+#ifdef _WIN32
+    return _commit(_fileno(f)) == 0;
+#else
+    return fsync(fileno(f)) == 0;
+#endif
+}
+
+// 截斷到最後一筆完整記錄，之後追加的記錄才不會接在殘缺資料後面而在重播時遺失
+static inline int state_truncate_file(const char* path, long long size) {
+    FILE* f = fopen(path, "r+b");
+    int ok;
+    if (!f) return 0;
+#ifdef _WIN32
+    ok = _chsize_s(_fileno(f), size) == 0;
+#else
+    ok = ftruncate(fileno(f), (off_t)size) == 0;
+#endif
+    ok = state_sync_file(f) && ok;
+    return fclose(f) == 0 && ok;
+}
+
+static inline int state_replace_file(const char* from, const char* to) {
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    char dir[4096] = ".";
+    const char* slash = strrchr(to, '/');
+    int fd, ok;
+    if (rename(from, to) != 0) return 0;
+    // rename 本身要等所在目錄落地才算完成
+    if (slash && (size_t)(slash - to) + 2 <= sizeof(dir)) {
+        memcpy(dir, to, (size_t)(slash - to) + 1);
+        dir[slash - to + 1] = '\0';
+    }
+    fd = open(dir, O_RDONLY);
+    if (fd < 0) return 0;
+    ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+#endif
+}
+
+static inline unsigned int state_fnv32(unsigned int c, const void* p, size_t n) {
+    const unsigned char* b = (const unsigned char*)p;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        c ^= b[i];
+        c *= 16777619u;
+    }
+    return c;
+}
+
+static inline unsigned long long state_fnv64(unsigned long long c, const void* p, size_t n) {
+    const unsigned char* b = (const unsigned char*)p;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        c ^= b[i];
+        c *= 1099511628211ULL;
+    }
+    return c;
+}
+
+#define STATE_FNV32_INIT 2166136261u
+#define STATE_FNV64_INIT 14695981039346656037ULL
+
+#endif
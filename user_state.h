@@ -0,0 +1,164 @@
+// project_2_defend 的持久化使用者狀態：預寫日誌 (WAL) + 快照
+// 每次狀態變動追加一筆 StateRecord 到日誌並 fsync，達 USER_STATE_COMPACT_EVERY 筆後
+// 將目前狀態寫成快照 (暫存檔 + rename) 並清空日誌。重啟時讀快照再重播日誌，
+// 遇到校驗失敗或不完整的記錄 (寫到一半當機) 即停止，截斷到最後一筆完整記錄並立即壓縮。
+// 快照存在但驗證失敗時移到 <prefix>.snap.corrupt 保留，只從日誌還原；移不走就停止壓縮，避免覆蓋。
+// 檔名由 prefix 決定 (<prefix>.snap / <prefix>.wal)，測試使用自己的 prefix，不會碰到正式檔案。
+#ifndef USER_STATE_H
+#define USER_STATE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "state_file.h"
+
+#define USER_STATE_COMPACT_EVERY 64   // 日誌累積筆數達此值即壓縮成快照
+#define USER_STATE_PATH_MAX 260
+
+typedef struct {
+    char username[50];
+    int fail_count;
+    time_t block_until;
+} UserStatus;
+
+// 快照與日誌共用的固定長度記錄：校驗碼 + 使用者狀態原始位元組
+// (校驗碼用 64 位元，記錄中不會留下校驗不到的對齊空隙)
+typedef struct {
+    unsigned long long checksum;
+    UserStatus status;
+} StateRecord;
+
+typedef struct {
+    char snapshot[USER_STATE_PATH_MAX];
+    char snapshot_tmp[USER_STATE_PATH_MAX];
+    char snapshot_corrupt[USER_STATE_PATH_MAX];
+    char journal_path[USER_STATE_PATH_MAX];
+    FILE* journal;
+    int journal_records;
+    int snapshot_locked;   // 損毀的快照無法移走，不可壓縮覆蓋
+} UserStateStore;
+
+// user_state_load / user_state_save 的回傳旗標，交由呼叫端決定如何記錄
+enum {
+    USER_STATE_RESTORED = 1,        // 從快照或日誌還原了狀態
+    USER_STATE_TORN_TAIL = 2,       // 日誌尾端不完整，已截斷
+    USER_STATE_WRITE_FAILED = 4,    // 日誌寫入失敗，這次變動重啟後可能遺失
+    USER_STATE_COMPACT_FAILED = 8,
+    USER_STATE_SNAPSHOT_CORRUPT = 16   // 快照驗證失敗，已移到 .corrupt (snapshot_locked 表示沒移成)
+};
+
+static inline void user_state_init(UserStateStore* s, const char* prefix) {
+    memset(s, 0, sizeof(*s));
+    snprintf(s->snapshot, sizeof(s->snapshot), "%s.snap", prefix);
+    snprintf(s->snapshot_tmp, sizeof(s->snapshot_tmp), "%s.snap.tmp", prefix);
+    snprintf(s->snapshot_corrupt, sizeof(s->snapshot_corrupt), "%s.snap.corrupt", prefix);
+    snprintf(s->journal_path, sizeof(s->journal_path), "%s.wal", prefix);
+}
+
+static inline void user_state_close(UserStateStore* s) {
+    if (s->journal) fclose(s->journal);
+    s->journal = NULL;
+    s->journal_records = 0;
+}
+
+static inline unsigned long long user_state_checksum(const UserStatus* status) {
+    return state_fnv64(STATE_FNV64_INIT, status, sizeof(UserStatus));
+}
+
+static inline int user_state_read_record(FILE* f, UserStatus* out) {
+    StateRecord rec;
+    if (fread(&rec, sizeof(rec), 1, f) != 1) return 0;
+    if (rec.checksum != user_state_checksum(&rec.status)) return 0;
+    *out = rec.status;
+    return 1;
+}
+
+static inline int user_state_write_record(FILE* f, const UserStatus* status) {
+    StateRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    memcpy(&rec.status, status, sizeof(UserStatus));
+    rec.checksum = user_state_checksum(&rec.status);
+    if (fwrite(&rec, sizeof(rec), 1, f) != 1) return 0;
+    return state_sync_file(f);
+}
+
+static inline int user_state_compact(UserStateStore* s, const UserStatus* user) {
+    FILE* f;
+    int ok;
+    if (s->snapshot_locked) return 0;
+    f = fopen(s->snapshot_tmp, "wb");
+    if (!f) return 0;
+    ok = user_state_write_record(f, user);
+    ok = fclose(f) == 0 && ok;
+    if (!ok || !state_replace_file(s->snapshot_tmp, s->snapshot)) return 0;
+
+    if (s->journal) fclose(s->journal);
+    s->journal = fopen(s->journal_path, "wb");
+    s->journal_records = 0;
+    return s->journal != NULL;
+}
+
+// 只還原與 user->username 相同的記錄
+static inline int user_state_load(UserStateStore* s, UserStatus* user) {
+    UserStatus status;
+    FILE* f;
+    long long good = 0;
+    int flags = 0;
+
+    f = fopen(s->snapshot, "rb");
+    if (f) {
+        int valid = user_state_read_record(f, &status);
+        fclose(f);
+        if (!valid) {
+            flags |= USER_STATE_SNAPSHOT_CORRUPT;
+            if (!state_replace_file(s->snapshot, s->snapshot_corrupt)) s->snapshot_locked = 1;
+        } else if (strcmp(status.username, user->username) == 0) {
+            *user = status;
+            flags |= USER_STATE_RESTORED;
+        }
+    }
+
+    f = fopen(s->journal_path, "rb");
+    if (f) {
+        while (user_state_read_record(f, &status)) {
+            if (strcmp(status.username, user->username) == 0) {
+                *user = status;
+                flags |= USER_STATE_RESTORED;
+            }
+            s->journal_records++;
+            good += sizeof(StateRecord);
+        }
+        fseek(f, 0, SEEK_END);
+        if (ftell(f) != good) flags |= USER_STATE_TORN_TAIL;
+        fclose(f);
+    }
+
+    // 不論之後壓縮是否成功都先截斷；截斷失敗就不再追加，等壓縮重建日誌
+    if (!(flags & USER_STATE_TORN_TAIL) || state_truncate_file(s->journal_path, good)) {
+        s->journal = fopen(s->journal_path, "ab");
+    }
+    if (((flags & USER_STATE_TORN_TAIL) || s->journal_records >= USER_STATE_COMPACT_EVERY)
+        && !user_state_compact(s, user)) {
+        flags |= USER_STATE_COMPACT_FAILED;
+    }
+    return flags;
+}
+
+// 寫入失敗時撤掉寫了一半的記錄，之後的記錄才不會接在殘缺資料後面
+static inline int user_state_save(UserStateStore* s, const UserStatus* user) {
+    if (!s->journal || !user_state_write_record(s->journal, user)) {
+        if (s->journal) fclose(s->journal);
+        s->journal = NULL;
+        if (state_truncate_file(s->journal_path, s->journal_records * (long long)sizeof(StateRecord))) {
+            s->journal = fopen(s->journal_path, "ab");
+        }
+        return USER_STATE_WRITE_FAILED;
+    }
+    if (++s->journal_records >= USER_STATE_COMPACT_EVERY && !user_state_compact(s, user)) {
+        return USER_STATE_COMPACT_FAILED;
+    }
+    return 0;
+}
+
+#endif